@@ -0,0 +1,41 @@
+/*
+    lc3metrics.h
+
+    layout of the shared memory page a running lc3 publishes with --metrics,
+    read by lc3top. counters are updated with relaxed atomic stores at slice
+    boundaries, so a reader sees each value whole but not a consistent set.
+*/
+#ifndef LC3METRICS_H
+#define LC3METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LC3_METRICS_MAGIC 0x4D33434Cu /* "LC3M" */
+#define LC3_METRICS_VERSION 1
+#define LC3_METRICS_NAME "/lc3vm.%d" /* shm_open name, formatted with the vm pid */
+
+enum
+{
+    LC3_RUNNING = 0, /* executing guest instructions */
+    LC3_WAITING,     /* blocked reading a key for GETC/IN */
+    LC3_STOPPED      /* guest halted or was stopped */
+};
+
+struct lc3metrics
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    _Atomic uint32_t state;
+    _Atomic uint64_t updates;      /* number of publishes so far */
+    _Atomic uint64_t retired;      /* guest instructions executed */
+    _Atomic uint64_t pc;           /* program counter at the last publish */
+    _Atomic uint64_t kbsrPolls;    /* reads of the keyboard status register */
+    _Atomic uint64_t outputBytes;  /* bytes written by the output traps */
+    _Atomic uint64_t inputWaitNs;  /* time spent blocked waiting for a key */
+    _Atomic uint64_t opcodes[16];  /* instructions executed per opcode */
+    _Atomic uint64_t traps[256];   /* TRAP instructions executed per vector */
+};
+
+#endif
@@ -0,0 +1,106 @@
+/*
+    lc3top.c
+
+    shows the live counters of an lc3 started with --metrics
+    usage: lc3top pid [interval-seconds]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lc3metrics.h"
+
+static const char *opNames[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+static const char *stateNames[3] = {"running", "waiting for input", "stopped"};
+
+uint64_t load(_Atomic uint64_t *counter){
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2)
+    {
+        /* show usage string */
+        printf("lc3top pid [interval-seconds]\n");
+        exit(2);
+    }
+    int interval = argc > 2 ? atoi(argv[2]) : 1;
+    if (interval < 1) interval = 1;
+
+    char name[64];
+    snprintf(name, sizeof(name), LC3_METRICS_NAME, atoi(argv[1]));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        printf("no metrics for pid %s (is lc3 running with --metrics?)\n", argv[1]);
+        exit(1);
+    }
+    // a segment still being sized (or not ours) would SIGBUS on first read
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct lc3metrics))
+    {
+        printf("unrecognized metrics segment: %s\n", name);
+        exit(1);
+    }
+    struct lc3metrics *m = (struct lc3metrics *)mmap(NULL, sizeof(struct lc3metrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED || m->magic != LC3_METRICS_MAGIC || m->version != LC3_METRICS_VERSION)
+    {
+        printf("unrecognized metrics segment: %s\n", name);
+        exit(1);
+    }
+
+    uint64_t lastRetired = load(&m->retired);
+    uint64_t lastOutput = load(&m->outputBytes);
+    uint64_t lastPolls = load(&m->kbsrPolls);
+    for (;;)
+    {
+        sleep(interval);
+        uint32_t state = atomic_load_explicit(&m->state, memory_order_relaxed);
+        uint64_t retired = load(&m->retired);
+        uint64_t output = load(&m->outputBytes);
+        uint64_t polls = load(&m->kbsrPolls);
+
+        // clear the screen and home the cursor
+        printf("\033[H\033[J");
+        printf("lc3 pid %d  %s  PC x%04X\n\n", m->pid, state <= LC3_STOPPED ? stateNames[state] : "?",
+               (unsigned)load(&m->pc));
+        printf("instructions %16llu  %12.0f/s\n", (unsigned long long)retired,
+               (double)(retired - lastRetired) / interval);
+        printf("output bytes %16llu  %12.0f/s\n", (unsigned long long)output,
+               (double)(output - lastOutput) / interval);
+        printf("KBSR polls   %16llu  %12.0f/s\n", (unsigned long long)polls,
+               (double)(polls - lastPolls) / interval);
+        printf("input wait   %16.3f s\n\n", load(&m->inputWaitNs) / 1e9);
+
+        for (int i = 0; i < 16; i++)
+        {
+            uint64_t n = load(&m->opcodes[i]);
+            if (n) printf("%-5s %16llu  %5.1f%%\n", opNames[i], (unsigned long long)n, retired ? 100.0 * n / retired : 0);
+        }
+        printf("\n");
+        for (int i = 0; i < 256; i++)
+        {
+            uint64_t n = load(&m->traps[i]);
+            if (n) printf("TRAP x%02X %13llu\n", i, (unsigned long long)n);
+        }
+        fflush(stdout);
+
+        if (state == LC3_STOPPED) break;
+        lastRetired = retired;
+        lastOutput = output;
+        lastPolls = polls;
+    }
+    munmap(m, sizeof(struct lc3metrics));
+    return 0;
+}
@@ -4,17 +4,37 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <strings.h>
 #include <signal.h>
 /* unix only */
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+/* linux only */
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "lc3metrics.h"
 
 #define MEMORY_MAX (1 << 16)
+#define PAGE_SIZE 256 /* words per page for dirty tracking */
+#define PAGE_CT (MEMORY_MAX / PAGE_SIZE)
+#define DIRTY_WORDS (PAGE_CT / 64)
 
 enum
 {
@@ -58,7 +78,9 @@ enum
 enum
 {
     MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_CCLO = 0xFE08, /* cycle counter, low word (latches the high word) */
+    MR_CCHI = 0xFE0A  /* cycle counter, high word */
 };
 enum
 {
@@ -69,8 +91,30 @@ enum
     TRAP_PUTSP = 0x24, /* output a byte string */
     TRAP_HALT = 0x25   /* halt the program */
 };
+enum
+{
+    /* extended vectors, only with --ext-traps */
+    TRAP_MULS = 0x40,   /* R1:R0 = R0 * R1, signed */
+    TRAP_MULU = 0x41,   /* R1:R0 = R0 * R1, unsigned */
+    TRAP_DIVS = 0x42,   /* R0 = R0 / R1, signed */
+    TRAP_DIVU = 0x43,   /* R0 = R0 / R1, unsigned */
+    TRAP_MODS = 0x44,   /* R0 = R0 % R1, signed */
+    TRAP_MODU = 0x45,   /* R0 = R0 % R1, unsigned */
+    TRAP_MEMCPY = 0x46, /* copy R2 words from R1 to R0 */
+    TRAP_MEMSET = 0x47, /* fill R2 words at R0 with R1 */
+    TRAP_STRCMP = 0x48  /* R0 = -1, 0 or 1 comparing the word strings at R0 and R1 */
+};
+
+enum
+{
+    STOP_HALT = 0,   /* guest executed HALT */
+    STOP_STUCK = 3,  /* guest state repeated with no input consumed */
+    STOP_BUDGET = 4, /* instruction budget exhausted */
+    STOP_INPUT = 5   /* key stream exhausted */
+};
 
 uint16_t checkKeys();
+const char *symbolize(uint16_t address, char *buf, size_t size);
 
 /*
     memory 
@@ -79,9 +123,31 @@ struct lc3memory
 {
     uint16_t memory[MEMORY_MAX];
     uint16_t regstr[R_CT];
+    uint64_t retired; /* guest instructions executed */
+    uint64_t nextSlice; /* value of retired at which the current slice ends */
+    int timerMmio; /* expose the cycle counter at MR_CCLO/MR_CCHI */
+    int extTraps; /* accept the extended trap vectors */
+    int counters; /* keep the opcode, trap and poll counts, only --metrics reads them */
+    uint16_t cycleLatch; /* high word latched by the last MR_CCLO read */
+    uint64_t inputEvents; /* reads of anything outside the guest: keyboard, timer */
+    uint64_t dirty[DIRTY_WORDS]; /* pages written since last collected */
+    uint64_t opcodes[16]; /* instructions executed per opcode */
+    uint64_t traps[256]; /* TRAP instructions executed per vector */
+    uint64_t kbsrPolls;
+    uint64_t outputBytes;
+    uint64_t inputWaitNs; /* time blocked in GETC/IN */
+    const uint8_t *keyStream; /* keys come from here instead of stdin when set */
+    size_t keyStreamLen;
+    size_t keyStreamPos;
+    int pendingStop; /* stop reason raised outside the run loop */
 };
 typedef struct lc3memory vmState;
 
+int keyReady(vmState *vmState);
+uint16_t readKey(vmState *vmState);
+void latencyArrive(uint16_t key, int consumed);
+void latencyConsume();
+
 vmState *initMem(){
     
     vmState *mem = (vmState *)malloc(sizeof(vmState));
@@ -91,161 +157,2024 @@ vmState *initMem(){
     }
     for (int i = 0; i < R_CT; i++)
     {
-        mem->regstr[i]=0;
+        mem->regstr[i]=0;
+    }
+    mem->retired=0;
+    mem->nextSlice=0;
+    mem->timerMmio=0;
+    mem->extTraps=0;
+    mem->counters=0;
+    mem->cycleLatch=0;
+    mem->inputEvents=0;
+    for (int i = 0; i < DIRTY_WORDS; i++)
+    {
+        mem->dirty[i]=0;
+    }
+    memset(mem->opcodes, 0, sizeof(mem->opcodes));
+    memset(mem->traps, 0, sizeof(mem->traps));
+    mem->kbsrPolls=0;
+    mem->outputBytes=0;
+    mem->inputWaitNs=0;
+    mem->keyStream=NULL;
+    mem->keyStreamLen=0;
+    mem->keyStreamPos=0;
+    mem->pendingStop=0;
+    return mem;
+}
+
+void stopVm(vmState *vmState){
+    free(vmState);
+}
+
+void markDirty(vmState *vmState, uint16_t address){
+    vmState->dirty[address / (PAGE_SIZE * 64)] |= 1ull << ((address / PAGE_SIZE) % 64);
+}
+void mem_write(vmState *vmState, uint16_t address, uint16_t val){
+    vmState->memory[address]=val;
+    markDirty(vmState,address);
+}
+uint16_t mem_read(vmState *vmState,uint16_t address){
+    if (address == MR_KBSR)
+    {
+        vmState->inputEvents++;
+        if (vmState->counters) vmState->kbsrPolls++;
+        markDirty(vmState,MR_KBSR);
+        if (keyReady(vmState))
+        {
+            vmState->memory[MR_KBSR] = (1 << 15);
+            vmState->memory[MR_KBDR] = readKey(vmState);
+            latencyArrive(vmState->memory[MR_KBDR], 0);
+        }
+        else
+        {
+            vmState->memory[MR_KBSR] = 0;
+        }
+    }
+    else if (address == MR_KBDR)
+    {
+        latencyConsume();
+    }
+    else if (vmState->timerMmio && address == MR_CCLO)
+    {
+        /* one cycle per guest instruction */
+        vmState->inputEvents++;
+        vmState->cycleLatch = (uint16_t)(vmState->retired >> 16);
+        return (uint16_t)vmState->retired;
+    }
+    else if (vmState->timerMmio && address == MR_CCHI)
+    {
+        return vmState->cycleLatch;
+    }
+    return vmState->memory[address];
+}
+
+/*
+    terminal
+*/
+struct termios originalTio;
+
+void disableInputBuffering(){
+    
+    //get current terminal attributes and store it in variable
+    tcgetattr(STDIN_FILENO, &originalTio);
+    struct termios newTio = originalTio;
+    /*
+        disables both canonical mode (ICANON- terminal doesn't wait for a newline 
+        character (like pressing Enter) to complete a line of input) and echoing 
+        (ECHO- terminal doesn't display the characters the user types on the 
+        screen) for a terminal 
+    */ 
+   newTio.c_lflag &= ~ICANON & ~ECHO;
+   tcsetattr(STDIN_FILENO,TCSANOW,&newTio);
+}
+
+void restoreInputBuffering(){
+
+    // set orignal attributes back
+    tcsetattr(STDIN_FILENO, TCSANOW, &originalTio);
+}
+
+void handleInterrupt(int signal){
+    restoreInputBuffering();
+    printf("\n");
+    exit(-2);
+}
+
+uint16_t checkKeys(){
+    
+    fd_set readFds;
+    FD_ZERO(&readFds);
+    FD_SET(STDIN_FILENO,&readFds);
+
+    struct timeval timeout;
+    timeout.tv_sec=0,timeout.tv_usec=0;
+    return select(1,&readFds,NULL,NULL,&timeout)!=0;
+}
+
+/*
+    latency trace
+*/
+struct keystroke
+{
+    uint64_t arrive;   /* key read from the terminal */
+    uint64_t consume;  /* guest read it through KBDR or GETC/IN, 0 until then */
+    uint64_t firstOut; /* end of the first output flush after consume, 0 if none */
+    uint64_t lastOut;  /* end of the last output flush before the next key */
+    uint16_t key;
+};
+struct flushSpan
+{
+    uint64_t start;
+    uint64_t end;
+};
+struct latencyTrace
+{
+    int enabled;
+    const char *path;
+    uint64_t origin;
+    struct keystroke *keys;
+    size_t keyCount, keyCapacity;
+    struct flushSpan *flushes;
+    size_t flushCount, flushCapacity;
+    int pending; /* last key not consumed yet */
+    int afterEof; /* input ended, output is no longer attributed */
+};
+struct latencyTrace latency;
+
+uint64_t monotonicNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void latencyArrive(uint16_t key, int consumed){
+
+    if (!latency.enabled) return;
+    // end of file is not a keystroke, and what the guest prints next is not its answer
+    latency.afterEof = key == 0xFFFF;
+    if (latency.afterEof) return;
+    if (latency.keyCount == latency.keyCapacity)
+    {
+        latency.keyCapacity = latency.keyCapacity ? latency.keyCapacity * 2 : 256;
+        latency.keys = (struct keystroke *)realloc(latency.keys, latency.keyCapacity * sizeof(struct keystroke));
+    }
+    struct keystroke *k = &latency.keys[latency.keyCount++];
+    memset(k, 0, sizeof(*k));
+    k->key = key;
+    k->arrive = monotonicNs();
+    k->consume = consumed ? k->arrive : 0;
+    latency.pending = !consumed;
+}
+
+void latencyConsume(){
+
+    if (!latency.pending) return;
+    latency.keys[latency.keyCount - 1].consume = monotonicNs();
+    latency.pending = 0;
+}
+
+uint64_t latencyFlushBegin(){
+    return latency.enabled ? monotonicNs() : 0;
+}
+
+/* output is attributed to the last key once the guest has consumed it */
+void latencyFlushEnd(uint64_t start){
+
+    if (!latency.enabled || latency.keyCount == 0 || latency.pending || latency.afterEof) return;
+    struct keystroke *k = &latency.keys[latency.keyCount - 1];
+    uint64_t end = monotonicNs();
+    if (!k->firstOut) k->firstOut = end;
+    k->lastOut = end;
+
+    if (latency.flushCount == latency.flushCapacity)
+    {
+        latency.flushCapacity = latency.flushCapacity ? latency.flushCapacity * 2 : 1024;
+        latency.flushes = (struct flushSpan *)realloc(latency.flushes, latency.flushCapacity * sizeof(struct flushSpan));
+    }
+    latency.flushes[latency.flushCount].start = start;
+    latency.flushes[latency.flushCount].end = end;
+    latency.flushCount++;
+}
+
+void traceSpan(FILE *file, const char *name, int tid, uint64_t start, uint64_t end, int key){
+
+    fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"latency\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            name, tid, (start - latency.origin) / 1e3, (end - start) / 1e3);
+    if (key >= 0) fprintf(file, ",\"args\":{\"key\":%d}", key);
+    fprintf(file, "}");
+}
+
+int compareU64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void printPercentiles(const char *name, uint64_t *values, size_t count){
+
+    if (count == 0) return;
+    qsort(values, count, sizeof(uint64_t), compareU64);
+    fprintf(stderr, "latency: %-8s %9.3f %9.3f %9.3f %9.3f\n", name,
+            values[count * 50 / 100] / 1e6, values[count * 90 / 100] / 1e6,
+            values[count * 99 / 100] / 1e6, values[count - 1] / 1e6);
+}
+
+/* writes the Chrome/Perfetto trace and prints percentiles of the keystroke spans */
+void finishLatencyTrace(){
+
+    if (!latency.enabled) return;
+    latency.enabled = 0;
+
+    FILE *file = fopen(latency.path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "lc3: failed to write latency trace %s\n", latency.path);
+        return;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"keystrokes\"}}");
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"output flushes\"}}");
+
+    uint64_t *total = (uint64_t *)malloc((latency.keyCount + 1) * sizeof(uint64_t));
+    uint64_t *queued = (uint64_t *)malloc((latency.keyCount + 1) * sizeof(uint64_t));
+    uint64_t *guest = (uint64_t *)malloc((latency.keyCount + 1) * sizeof(uint64_t));
+    uint64_t *output = (uint64_t *)malloc((latency.keyCount + 1) * sizeof(uint64_t));
+    size_t answered = 0;
+    for (size_t i = 0; i < latency.keyCount; i++)
+    {
+        struct keystroke *k = &latency.keys[i];
+        if (!k->consume) continue;
+        if (!k->firstOut)
+        {
+            traceSpan(file, "queued", 1, k->arrive, k->consume, k->key);
+            continue;
+        }
+        traceSpan(file, "keystroke", 1, k->arrive, k->lastOut, k->key);
+        traceSpan(file, "queued", 1, k->arrive, k->consume, -1);
+        traceSpan(file, "guest", 1, k->consume, k->firstOut, -1);
+        traceSpan(file, "output", 1, k->firstOut, k->lastOut, -1);
+        total[answered] = k->lastOut - k->arrive;
+        queued[answered] = k->consume - k->arrive;
+        guest[answered] = k->firstOut - k->consume;
+        output[answered] = k->lastOut - k->firstOut;
+        answered++;
+    }
+    for (size_t i = 0; i < latency.flushCount; i++)
+    {
+        traceSpan(file, "flush", 2, latency.flushes[i].start, latency.flushes[i].end, -1);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    fprintf(stderr, "\nlatency: %zu keys, %zu followed by output, trace in %s\n",
+            latency.keyCount, answered, latency.path);
+    if (answered)
+    {
+        fprintf(stderr, "latency: %-8s %9s %9s %9s %9s\n", "ms", "p50", "p90", "p99", "max");
+        printPercentiles("total", total, answered);
+        printPercentiles("queued", queued, answered);
+        printPercentiles("guest", guest, answered);
+        printPercentiles("output", output, answered);
+    }
+    free(total);
+    free(queued);
+    free(guest);
+    free(output);
+}
+
+void startLatencyTrace(const char *path){
+
+    latency.enabled = 1;
+    latency.path = path;
+    latency.origin = monotonicNs();
+    atexit(finishLatencyTrace);
+}
+
+/*
+    output
+*/
+/* worst case PUTSP string: two bytes for every word, plus room for one vector store past the end */
+static char outBuf[2 * MEMORY_MAX + 32];
+
+/* one write for the whole buffer, after anything still queued in stdout */
+void vmWrite(const char *buf, size_t len){
+
+    uint64_t start = latencyFlushBegin();
+    fflush(stdout);
+    while (len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n <= 0) break;
+        buf += n;
+        len -= n;
+    }
+    latencyFlushEnd(start);
+}
+
+/*
+    narrows words to their low byte until a zero word, returns the string length
+    or count when no terminator was found. may store up to 15 bytes past the result.
+*/
+size_t packWordString(const uint16_t *src, size_t count, char *dst){
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(a, zero))
+                 | (_mm_movemask_epi8(_mm_cmpeq_epi16(b, zero)) << 16);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        if (!src[i]) return i;
+        dst[i] = (char)src[i];
+    }
+    return count;
+}
+
+/*
+    unpacks two characters per word (low byte first, a zero high byte is skipped)
+    until a zero word. *words receives the words consumed, the bytes written are returned.
+*/
+size_t packByteString(const uint16_t *src, size_t count, char *dst, size_t *words){
+
+    size_t i = 0, n = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high = _mm_set1_epi16((short)0xFF00);
+#endif
+    while (i < count)
+    {
+#ifdef __SSE2__
+        if (i + 8 <= count)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            int stop = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero))
+                     | _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero));
+            if (!stop)
+            {
+                /* little endian words already hold the bytes in output order */
+                _mm_storeu_si128((__m128i *)(dst + n), v);
+                n += 16;
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        // a block with the terminator or a short word goes one word at a time
+        size_t end = i + 8 < count ? i + 8 : count;
+        for (; i < end; i++)
+        {
+            if (!src[i])
+            {
+                *words = i;
+                return n;
+            }
+            dst[n++] = (char)(src[i] & 0xFF);
+            if (src[i] >> 8) dst[n++] = (char)(src[i] >> 8);
+        }
+    }
+    *words = count;
+    return n;
+}
+
+void trapPuts(vmState *vmState){
+
+    uint16_t address = vmState->regstr[R_R0];
+    size_t len = 0;
+    // the string may run off the end of memory and continue at x0000
+    while (len < MEMORY_MAX)
+    {
+        size_t run = MEMORY_MAX - address;
+        if (run > MEMORY_MAX - len) run = MEMORY_MAX - len;
+        size_t n = packWordString(vmState->memory + address, run, outBuf + len);
+        len += n;
+        if (n < run) break;
+        address = 0;
+    }
+    vmState->outputBytes += len;
+    vmWrite(outBuf, len);
+}
+
+void trapPutsp(vmState *vmState){
+
+    uint16_t address = vmState->regstr[R_R0];
+    size_t len = 0, scanned = 0;
+    while (scanned < MEMORY_MAX)
+    {
+        size_t run = MEMORY_MAX - address;
+        if (run > MEMORY_MAX - scanned) run = MEMORY_MAX - scanned;
+        size_t words;
+        len += packByteString(vmState->memory + address, run, outBuf + len, &words);
+        scanned += words;
+        if (words < run) break;
+        address = 0;
+    }
+    vmState->outputBytes += len;
+    vmWrite(outBuf, len);
+}
+
+/*
+    host performance counters
+*/
+enum
+{
+    PC_CYCLES = 0,    /* host cpu cycles */
+    PC_INSTRUCTIONS,  /* host instructions retired */
+    PC_BRANCH_MISSES, /* host branch mispredictions */
+    PC_L1I_MISSES,    /* host L1 instruction cache misses */
+    PC_L1D_MISSES,    /* host L1 data cache read misses */
+    PC_CT             /* number of counters */
+};
+struct perfCounters
+{
+    int enabled;
+    int fd[PC_CT];
+    uint64_t value[PC_CT];
+    struct timespec start, end;
+    const uint64_t *retired;
+};
+struct perfCounters perf;
+
+#ifdef __linux__
+int openPerfCounter(uint32_t type, uint64_t config){
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // count kernel time too (trap I/O syscalls), fall back to user only when not permitted
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+    {
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return fd;
+}
+#endif
+
+void startPerfCounters(const uint64_t *retired){
+
+    perf.enabled = 1;
+    perf.retired = retired;
+    for (int i = 0; i < PC_CT; i++)
+    {
+        perf.fd[i] = -1;
+    }
+#ifdef __linux__
+    perf.fd[PC_CYCLES] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    perf.fd[PC_INSTRUCTIONS] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf.fd[PC_BRANCH_MISSES] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    perf.fd[PC_L1I_MISSES] = openPerfCounter(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    perf.fd[PC_L1D_MISSES] = openPerfCounter(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    for (int i = 0; i < PC_CT; i++)
+    {
+        if (perf.fd[i] >= 0) ioctl(perf.fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &perf.start);
+}
+
+void stopPerfCounters(){
+
+    if (!perf.enabled) return;
+    perf.enabled = 0;
+    clock_gettime(CLOCK_MONOTONIC, &perf.end);
+    for (int i = 0; i < PC_CT; i++)
+    {
+        if (perf.fd[i] < 0) continue;
+#ifdef __linux__
+        ioctl(perf.fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        /* value, time enabled, time running */
+        uint64_t data[3];
+        if (read(perf.fd[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+        {
+            // scale up if the kernel had to multiplex the counter
+            perf.value[i] = (uint64_t)((double)data[0] * data[1] / data[2]);
+        }
+        else
+        {
+            perf.value[i] = 0;
+        }
+#endif
+        close(perf.fd[i]);
+    }
+}
+
+void reportPerfCounters(){
+
+    static const char *names[PC_CT] = {
+        "cycles", "instructions", "branch-misses", "L1i-misses", "L1d-misses"
+    };
+    static const char *units[PC_CT] = {
+        "per guest instr", "per guest instr", "per dispatch", "per guest instr", "per guest instr"
+    };
+
+    if (!perf.enabled) return;
+    stopPerfCounters();
+
+    uint64_t guest = *perf.retired;
+    double elapsed = (perf.end.tv_sec - perf.start.tv_sec) * 1e9 + (perf.end.tv_nsec - perf.start.tv_nsec);
+    double perInstr = guest ? 1.0 / guest : 0;
+
+    fprintf(stderr, "\nperf: %llu guest instructions in %.3f s", (unsigned long long)guest, elapsed / 1e9);
+    fprintf(stderr, " (%.2f ns per guest instr)\n", elapsed * perInstr);
+    int available = 0;
+    for (int i = 0; i < PC_CT; i++)
+    {
+        if (perf.fd[i] < 0)
+        {
+            fprintf(stderr, "perf: %-14s not available\n", names[i]);
+            continue;
+        }
+        fprintf(stderr, "perf: %-14s %14llu  %10.4f %s\n", names[i],
+                (unsigned long long)perf.value[i], perf.value[i] * perInstr, units[i]);
+        available++;
+    }
+    if (!available)
+    {
+        fprintf(stderr, "perf: hardware counters unavailable (perf_event_open denied or unsupported)\n");
+    }
+}
+
+/*
+    clock
+*/
+#define SLICE_MAX 65536 /* instructions between slice boundaries */
+
+struct vmClock
+{
+    uint64_t hz; /* target guest instructions per second, 0 runs unthrottled */
+    uint64_t slice;
+    struct timespec start;
+};
+struct vmClock vmClock;
+
+void startClock(uint64_t hz){
+
+    vmClock.hz = hz;
+    vmClock.slice = SLICE_MAX;
+    if (hz)
+    {
+        // pace roughly every millisecond of guest time
+        vmClock.slice = hz / 1000;
+        if (vmClock.slice == 0) vmClock.slice = 1;
+        if (vmClock.slice > SLICE_MAX) vmClock.slice = SLICE_MAX;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &vmClock.start);
+}
+
+void paceClock(uint64_t retired){
+
+    /* when the guest should reach this instruction count */
+    uint64_t due = (uint64_t)vmClock.start.tv_sec * 1000000000ull + vmClock.start.tv_nsec
+                 + (uint64_t)((double)retired * 1e9 / vmClock.hz);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t nowNs = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    uint64_t sliceNs = (uint64_t)((double)vmClock.slice * 1e9 / vmClock.hz);
+    if (nowNs > due + sliceNs)
+    {
+        // fell behind (blocked on input, descheduled): re-anchor so the guest doesn't sprint to catch up
+        uint64_t start = (uint64_t)vmClock.start.tv_sec * 1000000000ull + vmClock.start.tv_nsec + (nowNs - due);
+        vmClock.start.tv_sec = start / 1000000000ull;
+        vmClock.start.tv_nsec = start % 1000000000ull;
+        return;
+    }
+    if (nowNs >= due) return;
+
+    // ahead of schedule: sleep instead of spinning
+    struct timespec wait;
+    wait.tv_sec = (due - nowNs) / 1000000000ull;
+    wait.tv_nsec = (due - nowNs) % 1000000000ull;
+    while (nanosleep(&wait, &wait) != 0)
+        ;
+}
+
+/*
+    metrics
+*/
+struct lc3metrics *metrics;
+char metricsName[64];
+
+void publishMetrics(vmState *vmState, uint32_t state){
+
+    if (!metrics) return;
+    atomic_store_explicit(&metrics->retired, vmState->retired, memory_order_relaxed);
+    atomic_store_explicit(&metrics->pc, vmState->regstr[R_PC], memory_order_relaxed);
+    atomic_store_explicit(&metrics->kbsrPolls, vmState->kbsrPolls, memory_order_relaxed);
+    atomic_store_explicit(&metrics->outputBytes, vmState->outputBytes, memory_order_relaxed);
+    atomic_store_explicit(&metrics->inputWaitNs, vmState->inputWaitNs, memory_order_relaxed);
+    for (int i = 0; i < 16; i++)
+    {
+        atomic_store_explicit(&metrics->opcodes[i], vmState->opcodes[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        atomic_store_explicit(&metrics->traps[i], vmState->traps[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&metrics->state, state, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->updates, 1, memory_order_relaxed);
+}
+
+void removeMetrics(){
+
+    if (!metrics) return;
+    atomic_store_explicit(&metrics->state, LC3_STOPPED, memory_order_relaxed);
+    munmap(metrics, sizeof(struct lc3metrics));
+    metrics = NULL;
+    shm_unlink(metricsName);
+}
+
+int startMetrics(){
+
+    snprintf(metricsName, sizeof(metricsName), LC3_METRICS_NAME, (int)getpid());
+    // left behind by an earlier process with our pid that died without running atexit
+    shm_unlink(metricsName);
+    int fd = shm_open(metricsName, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return 0;
+    if (ftruncate(fd, sizeof(struct lc3metrics)) != 0)
+    {
+        close(fd);
+        shm_unlink(metricsName);
+        return 0;
+    }
+    void *page = mmap(NULL, sizeof(struct lc3metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        shm_unlink(metricsName);
+        return 0;
+    }
+    metrics = (struct lc3metrics *)page;
+    metrics->magic = LC3_METRICS_MAGIC;
+    metrics->version = LC3_METRICS_VERSION;
+    metrics->pid = (int32_t)getpid();
+    atexit(removeMetrics);
+    return 1;
+}
+
+/*
+    input
+*/
+/* ends the run before the next instruction */
+void requestStop(vmState *vmState, int reason){
+    vmState->pendingStop = reason;
+    vmState->nextSlice = vmState->retired + 1;
+}
+
+int keyReady(vmState *vmState){
+
+    if (!vmState->keyStream) return checkKeys();
+    if (vmState->keyStreamPos < vmState->keyStreamLen) return 1;
+    requestStop(vmState, STOP_INPUT);
+    return 0;
+}
+
+uint16_t readKey(vmState *vmState){
+
+    if (!vmState->keyStream) return (uint16_t)getchar();
+    if (vmState->keyStreamPos < vmState->keyStreamLen) return vmState->keyStream[vmState->keyStreamPos++];
+    requestStop(vmState, STOP_INPUT);
+    return 0xFFFF; /* what getchar gives at end of file */
+}
+
+/* blocking read of one key for GETC/IN, the time spent waiting is accounted to the guest */
+uint16_t waitForChar(vmState *vmState){
+
+    struct timespec start, end;
+    publishMetrics(vmState, LC3_WAITING);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint16_t c = readKey(vmState);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latencyArrive(c, 1);
+    vmState->inputWaitNs += (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+    vmState->inputEvents++;
+    publishMetrics(vmState, LC3_RUNNING);
+    return c;
+}
+
+/*
+    liveness
+*/
+struct loopCheck
+{
+    uint64_t interval; /* instructions between state hashes, 0 disables the check */
+    uint64_t nextCheck;
+    uint64_t budget; /* stop after this many instructions, 0 for no limit */
+    int quiet; /* no diagnostics, a stop is routine when fuzzing */
+    uint64_t pageHash[PAGE_CT];
+    uint64_t memoryHash; /* combination of every pageHash */
+    uint64_t hashDirty[DIRTY_WORDS]; /* pages whose pageHash is stale */
+    uint64_t snapDirty[DIRTY_WORDS]; /* pages that may differ from the snapshot */
+    uint16_t *snapMemory;
+    uint16_t snapRegs[R_CT];
+    uint64_t snapHash;
+    uint64_t snapRetired;
+    uint64_t snapInputs; /* inputEvents when the snapshot was taken */
+    uint64_t power, lam; /* Brent's cycle finding over the checkpoint states */
+};
+struct loopCheck loopCheck;
+
+uint64_t mixHash(uint64_t h, uint64_t x){
+
+    h = (h ^ x) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+uint64_t hashPage(const uint16_t *page, int index){
+
+    uint64_t h = index + 1;
+    for (int i = 0; i < PAGE_SIZE / 4; i++)
+    {
+        // memcpy rather than a uint64_t pointer, memory is only ever accessed as uint16_t
+        uint64_t word;
+        memcpy(&word, page + i * 4, sizeof(word));
+        h = mixHash(h, word);
+    }
+    return h;
+}
+
+/* only pages written since the last check are rehashed */
+uint64_t stateHash(vmState *vmState){
+
+    for (int w = 0; w < DIRTY_WORDS; w++)
+    {
+        while (loopCheck.hashDirty[w])
+        {
+            int page = w * 64 + __builtin_ctzll(loopCheck.hashDirty[w]);
+            loopCheck.hashDirty[w] &= loopCheck.hashDirty[w] - 1;
+            uint64_t h = hashPage(vmState->memory + page * PAGE_SIZE, page);
+            loopCheck.memoryHash ^= loopCheck.pageHash[page] ^ h;
+            loopCheck.pageHash[page] = h;
+        }
+    }
+    uint64_t h = loopCheck.memoryHash;
+    for (int i = 0; i < R_CT; i++)
+    {
+        h = mixHash(h, vmState->regstr[i]);
+    }
+    return h;
+}
+
+void takeSnapshot(vmState *vmState, uint64_t hash){
+
+    for (int w = 0; w < DIRTY_WORDS; w++)
+    {
+        while (loopCheck.snapDirty[w])
+        {
+            int page = w * 64 + __builtin_ctzll(loopCheck.snapDirty[w]);
+            loopCheck.snapDirty[w] &= loopCheck.snapDirty[w] - 1;
+            memcpy(loopCheck.snapMemory + page * PAGE_SIZE, vmState->memory + page * PAGE_SIZE,
+                   PAGE_SIZE * sizeof(uint16_t));
+        }
+    }
+    memcpy(loopCheck.snapRegs, vmState->regstr, sizeof(loopCheck.snapRegs));
+    loopCheck.snapHash = hash;
+    loopCheck.snapRetired = vmState->retired;
+    loopCheck.snapInputs = vmState->inputEvents;
+}
+
+/* a hash match is confirmed against the snapshot, so a reported loop is never a collision */
+int sameAsSnapshot(vmState *vmState){
+
+    if (memcmp(loopCheck.snapRegs, vmState->regstr, sizeof(loopCheck.snapRegs)) != 0) return 0;
+    for (int page = 0; page < PAGE_CT; page++)
+    {
+        if (!(loopCheck.snapDirty[page / 64] >> (page % 64) & 1)) continue;
+        if (memcmp(loopCheck.snapMemory + page * PAGE_SIZE, vmState->memory + page * PAGE_SIZE,
+                   PAGE_SIZE * sizeof(uint16_t)) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void startLoopCheck(vmState *vmState, uint64_t interval, uint64_t budget){
+
+    loopCheck.interval = interval;
+    loopCheck.budget = budget;
+    if (!interval) return;
+
+    loopCheck.snapMemory = (uint16_t *)malloc(MEMORY_MAX * sizeof(uint16_t));
+    for (int w = 0; w < DIRTY_WORDS; w++)
+    {
+        loopCheck.hashDirty[w] = ~0ull;
+        loopCheck.snapDirty[w] = ~0ull;
+        vmState->dirty[w] = 0;
+    }
+    loopCheck.memoryHash = 0;
+    memset(loopCheck.pageHash, 0, sizeof(loopCheck.pageHash));
+    takeSnapshot(vmState, stateHash(vmState));
+    loopCheck.power = loopCheck.lam = 1;
+    loopCheck.nextCheck = vmState->retired + interval;
+}
+
+/*
+    between input events the guest is deterministic, so once the state at one
+    checkpoint equals an earlier one it will repeat forever. returns 1 when stuck.
+*/
+int checkLoop(vmState *vmState){
+
+    loopCheck.nextCheck = vmState->retired + loopCheck.interval;
+    for (int w = 0; w < DIRTY_WORDS; w++)
+    {
+        loopCheck.hashDirty[w] |= vmState->dirty[w];
+        loopCheck.snapDirty[w] |= vmState->dirty[w];
+        vmState->dirty[w] = 0;
+    }
+    uint64_t hash = stateHash(vmState);
+    if (vmState->inputEvents != loopCheck.snapInputs)
+    {
+        takeSnapshot(vmState, hash);
+        loopCheck.power = loopCheck.lam = 1;
+        return 0;
+    }
+    if (hash == loopCheck.snapHash && sameAsSnapshot(vmState))
+    {
+        char at[64];
+        if (loopCheck.quiet) return 1;
+        /* the instruction at PC - 1 has been fetched but not executed */
+        fprintf(stderr, "\nlc3: stuck at %s: state after %llu instructions repeats the state after %llu, no input consumed\n",
+                symbolize(vmState->regstr[R_PC] - 1, at, sizeof(at)),
+                (unsigned long long)vmState->retired, (unsigned long long)loopCheck.snapRetired);
+        return 1;
+    }
+    if (loopCheck.lam == loopCheck.power)
+    {
+        takeSnapshot(vmState, hash);
+        loopCheck.power *= 2;
+        loopCheck.lam = 0;
+    }
+    loopCheck.lam++;
+    return 0;
+}
+
+void scheduleSlice(vmState *vmState){
+
+    // the slice ends at whichever comes first
+    uint64_t next = vmState->retired + vmClock.slice;
+    if (loopCheck.interval && loopCheck.nextCheck < next) next = loopCheck.nextCheck;
+    // retired counts the fetched instruction, so the budget runs out when fetching one more
+    if (loopCheck.budget && loopCheck.budget + 1 < next) next = loopCheck.budget + 1;
+    vmState->nextSlice = next;
+}
+
+/* runs pacing and checks at the end of a slice, returns nonzero to stop the guest */
+int endSlice(vmState *vmState){
+
+    if (vmState->pendingStop)
+    {
+        return vmState->pendingStop;
+    }
+    publishMetrics(vmState, LC3_RUNNING);
+    if (vmClock.hz)
+    {
+        paceClock(vmState->retired);
+    }
+    if (loopCheck.interval && vmState->retired >= loopCheck.nextCheck && checkLoop(vmState))
+    {
+        return STOP_STUCK;
+    }
+    if (loopCheck.budget && vmState->retired > loopCheck.budget)
+    {
+        char at[64];
+        if (loopCheck.quiet) return STOP_BUDGET;
+        fprintf(stderr, "\nlc3: instruction budget of %llu exhausted at %s\n",
+                (unsigned long long)loopCheck.budget, symbolize(vmState->regstr[R_PC] - 1, at, sizeof(at)));
+        return STOP_BUDGET;
+    }
+    scheduleSlice(vmState);
+    return 0;
+}
+
+/*
+    helper functions
+*/
+uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1) {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+void update_flags(vmState *vmState,int regId){
+    
+    if (vmState->regstr[regId] == 0)
+    {
+        vmState->regstr[R_CD] = COND_Z;
+    }
+    else if (vmState->regstr[regId] >> 15) /* a 1 in the left-most bit indicates negative */
+    {
+        vmState->regstr[R_CD] = COND_N;
+    }
+    else
+    {
+        vmState->regstr[R_CD] = COND_P;
+    }
+    
+}
+int readImageFile(vmState *vmState,const char* imgPath){
+    
+    FILE *file = fopen(imgPath,"rb");
+    if (!file)return 0;
+    
+    uint16_t origin;
+    fread(&origin,sizeof(uint16_t),1,file);
+    origin=swap16(origin);
+    // vmState->regstr[R_PC]=origin;
+
+    uint16_t max_read = MEMORY_MAX - origin;
+    uint16_t *p = vmState->memory + origin;
+    int read = fread(p, sizeof(uint16_t), max_read, file);
+
+    while (read-- >0 )
+    {
+        *p=swap16(*p);
+        p++;
+    }
+    fclose(file);
+    return 1;
+}
+
+/*
+    extended traps
+*/
+/* copies count words between guest addresses, wrapping at the end of memory */
+void copyOut(const vmState *vmState, uint16_t address, uint16_t *dst, size_t count){
+
+    size_t first = (size_t)(MEMORY_MAX - address) < count ? (size_t)(MEMORY_MAX - address) : count;
+    memcpy(dst, vmState->memory + address, first * sizeof(uint16_t));
+    memcpy(dst + first, vmState->memory, (count - first) * sizeof(uint16_t));
+}
+
+void copyIn(vmState *vmState, uint16_t address, const uint16_t *src, size_t count){
+
+    size_t first = (size_t)(MEMORY_MAX - address) < count ? (size_t)(MEMORY_MAX - address) : count;
+    memcpy(vmState->memory + address, src, first * sizeof(uint16_t));
+    memcpy(vmState->memory, src + first, (count - first) * sizeof(uint16_t));
+}
+
+void fillWords(uint16_t *dst, uint16_t value, size_t count){
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi16((short)value);
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] = value;
+    }
+}
+
+void markDirtyRange(vmState *vmState, uint16_t address, size_t count){
+
+    // one mark per page is enough
+    for (size_t done = 0; done < count; )
+    {
+        markDirty(vmState, address);
+        size_t step = PAGE_SIZE - address % PAGE_SIZE;
+        done += step;
+        address += step;
+    }
+}
+
+/* R0 = quotient, division by zero gives xFFFF and INT16_MIN / -1 gives INT16_MIN */
+void extDivide(vmState *vmState, int isSigned, int wantRemainder){
+
+    uint16_t a = vmState->regstr[R_R0], b = vmState->regstr[R_R1];
+    uint16_t q, r;
+    if (b == 0)
+    {
+        q = 0xFFFF;
+        r = a;
+    }
+    else if (isSigned)
+    {
+        int32_t sa = (int16_t)a, sb = (int16_t)b;
+        q = (uint16_t)(sa / sb);
+        r = (uint16_t)(sa % sb);
+    }
+    else
+    {
+        q = a / b;
+        r = a % b;
+    }
+    vmState->regstr[R_R0] = wantRemainder ? r : q;
+}
+
+/* returns 0 for a vector that is not an extended trap */
+int trapExt(vmState *vmState, uint16_t vector){
+
+    static uint16_t block[MEMORY_MAX];
+    uint16_t *reg = vmState->regstr;
+    switch (vector)
+    {
+    case TRAP_MULS:
+    {
+        uint32_t product = (uint32_t)((int32_t)(int16_t)reg[R_R0] * (int16_t)reg[R_R1]);
+        reg[R_R0] = (uint16_t)product;
+        reg[R_R1] = (uint16_t)(product >> 16);
+    }
+        break;
+    case TRAP_MULU:
+    {
+        uint32_t product = (uint32_t)reg[R_R0] * reg[R_R1];
+        reg[R_R0] = (uint16_t)product;
+        reg[R_R1] = (uint16_t)(product >> 16);
+    }
+        break;
+    case TRAP_DIVS: extDivide(vmState, 1, 0); break;
+    case TRAP_DIVU: extDivide(vmState, 0, 0); break;
+    case TRAP_MODS: extDivide(vmState, 1, 1); break;
+    case TRAP_MODU: extDivide(vmState, 0, 1); break;
+    case TRAP_MEMCPY:
+        if (reg[R_R2] <= MEMORY_MAX - reg[R_R0] && reg[R_R2] <= MEMORY_MAX - reg[R_R1])
+        {
+            memmove(vmState->memory + reg[R_R0], vmState->memory + reg[R_R1], reg[R_R2] * sizeof(uint16_t));
+        }
+        else
+        {
+            // a range wraps: through a buffer so overlapping ranges still behave like memmove
+            copyOut(vmState, reg[R_R1], block, reg[R_R2]);
+            copyIn(vmState, reg[R_R0], block, reg[R_R2]);
+        }
+        markDirtyRange(vmState, reg[R_R0], reg[R_R2]);
+        return 1;
+    case TRAP_MEMSET:
+    {
+        uint16_t address = reg[R_R0];
+        size_t count = reg[R_R2];
+        size_t first = (size_t)(MEMORY_MAX - address) < count ? (size_t)(MEMORY_MAX - address) : count;
+        fillWords(vmState->memory + address, reg[R_R1], first);
+        fillWords(vmState->memory, reg[R_R1], count - first);
+        markDirtyRange(vmState, address, count);
+    }
+        return 1;
+    case TRAP_STRCMP:
+    {
+        uint16_t a = reg[R_R0], b = reg[R_R1];
+        int result = 0;
+        for (int n = 0; n < MEMORY_MAX; n++, a++, b++)
+        {
+            uint16_t ca = vmState->memory[a], cb = vmState->memory[b];
+            if (ca != cb)
+            {
+                result = ca < cb ? -1 : 1;
+                break;
+            }
+            if (!ca) break;
+        }
+        reg[R_R0] = (uint16_t)result;
+    }
+        break;
+    default:
+        return 0;
+    }
+    update_flags(vmState, R_R0);
+    return 1;
+}
+
+/*
+    symbol table
+*/
+struct symbol
+{
+    char *name;
+    uint16_t address;
+};
+struct symbolTable
+{
+    struct symbol *entries;
+    int count;
+    int capacity;
+};
+struct symbolTable symbols;
+
+void addSymbol(const char *name, uint16_t address){
+
+    if (symbols.count == symbols.capacity)
+    {
+        symbols.capacity = symbols.capacity ? symbols.capacity * 2 : 64;
+        symbols.entries = (struct symbol *)realloc(symbols.entries, symbols.capacity * sizeof(struct symbol));
+    }
+    symbols.entries[symbols.count].name = strdup(name);
+    symbols.entries[symbols.count].address = address;
+    symbols.count++;
+}
+
+/* search from entry first onwards so each source file only sees its own labels */
+int findSymbol(int first, const char *name){
+
+    for (int i = first; i < symbols.count; i++)
+    {
+        if (strcmp(symbols.entries[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/* formats an address as LABEL or LABEL+offset using the closest preceding symbol */
+const char *symbolize(uint16_t address, char *buf, size_t size){
+
+    int best = -1;
+    for (int i = 0; i < symbols.count; i++)
+    {
+        uint16_t at = symbols.entries[i].address;
+        if (at <= address && (best < 0 || at > symbols.entries[best].address)) best = i;
+    }
+    if (best < 0)
+    {
+        snprintf(buf, size, "x%04X", address);
+    }
+    else if (symbols.entries[best].address == address)
+    {
+        snprintf(buf, size, "%s", symbols.entries[best].name);
+    }
+    else
+    {
+        snprintf(buf, size, "%s+%d", symbols.entries[best].name, address - symbols.entries[best].address);
+    }
+    return buf;
+}
+
+int writeSymbolFile(const char *path){
+
+    FILE *file = fopen(path, "w");
+    if (!file) return 0;
+    for (int i = 0; i < symbols.count; i++)
+    {
+        fprintf(file, "%-24s x%04X\n", symbols.entries[i].name, symbols.entries[i].address);
+    }
+    fclose(file);
+    return 1;
+}
+
+/*
+    assembler
+*/
+#define ASM_LINE_MAX 1024
+#define ASM_TOKENS_MAX 8
+
+enum
+{
+    ASM_ADDAND = 0, /* DR, SR1, SR2 or imm5 */
+    ASM_NOT,        /* DR, SR */
+    ASM_BR,         /* PCoffset9 */
+    ASM_JMP,        /* BaseR */
+    ASM_JSR,        /* PCoffset11 */
+    ASM_PCOFF9,     /* R, PCoffset9 */
+    ASM_BASEOFF6,   /* R, BaseR, offset6 */
+    ASM_TRAP,       /* trapvect8 */
+    ASM_FIXED       /* no operands */
+};
+struct asmOp
+{
+    const char *name;
+    int kind;
+    uint16_t base;
+};
+static const struct asmOp asmOps[] = {
+    {"ADD", ASM_ADDAND, OP_ADD << 12},
+    {"AND", ASM_ADDAND, OP_AND << 12},
+    {"NOT", ASM_NOT, (OP_NOT << 12) | 0x3F},
+    {"BR", ASM_BR, (OP_BR << 12) | 0x0E00},
+    {"BRN", ASM_BR, (OP_BR << 12) | 0x0800},
+    {"BRZ", ASM_BR, (OP_BR << 12) | 0x0400},
+    {"BRP", ASM_BR, (OP_BR << 12) | 0x0200},
+    {"BRNZ", ASM_BR, (OP_BR << 12) | 0x0C00},
+    {"BRNP", ASM_BR, (OP_BR << 12) | 0x0A00},
+    {"BRZP", ASM_BR, (OP_BR << 12) | 0x0600},
+    {"BRNZP", ASM_BR, (OP_BR << 12) | 0x0E00},
+    {"JMP", ASM_JMP, OP_JMP << 12},
+    {"RET", ASM_FIXED, (OP_JMP << 12) | (R_R7 << 6)},
+    {"JSR", ASM_JSR, (OP_JSR << 12) | 0x0800},
+    {"JSRR", ASM_JMP, OP_JSR << 12},
+    {"LD", ASM_PCOFF9, OP_LD << 12},
+    {"LDI", ASM_PCOFF9, OP_LDI << 12},
+    {"LEA", ASM_PCOFF9, OP_LEA << 12},
+    {"ST", ASM_PCOFF9, OP_ST << 12},
+    {"STI", ASM_PCOFF9, OP_STI << 12},
+    {"LDR", ASM_BASEOFF6, OP_LDR << 12},
+    {"STR", ASM_BASEOFF6, OP_STR << 12},
+    {"TRAP", ASM_TRAP, OP_TRAP << 12},
+    {"RTI", ASM_FIXED, OP_RTI << 12},
+    {"GETC", ASM_FIXED, (OP_TRAP << 12) | TRAP_GETC},
+    {"OUT", ASM_FIXED, (OP_TRAP << 12) | TRAP_OUT},
+    {"PUTS", ASM_FIXED, (OP_TRAP << 12) | TRAP_PUTS},
+    {"IN", ASM_FIXED, (OP_TRAP << 12) | TRAP_IN},
+    {"PUTSP", ASM_FIXED, (OP_TRAP << 12) | TRAP_PUTSP},
+    {"HALT", ASM_FIXED, (OP_TRAP << 12) | TRAP_HALT},
+};
+/* only known with --ext-traps, so older programs may still use these as labels */
+static const struct asmOp asmExtOps[] = {
+    {"MULS", ASM_FIXED, (OP_TRAP << 12) | TRAP_MULS},
+    {"MULU", ASM_FIXED, (OP_TRAP << 12) | TRAP_MULU},
+    {"DIVS", ASM_FIXED, (OP_TRAP << 12) | TRAP_DIVS},
+    {"DIVU", ASM_FIXED, (OP_TRAP << 12) | TRAP_DIVU},
+    {"MODS", ASM_FIXED, (OP_TRAP << 12) | TRAP_MODS},
+    {"MODU", ASM_FIXED, (OP_TRAP << 12) | TRAP_MODU},
+    {"MEMCPY", ASM_FIXED, (OP_TRAP << 12) | TRAP_MEMCPY},
+    {"MEMSET", ASM_FIXED, (OP_TRAP << 12) | TRAP_MEMSET},
+    {"STRCMP", ASM_FIXED, (OP_TRAP << 12) | TRAP_STRCMP},
+};
+
+struct asmState
+{
+    vmState *vm;
+    const char *path;
+    int line;
+    int pass;        /* 1 collects symbols, 2 writes memory */
+    int firstSymbol; /* first symbol table entry of this file */
+    int inSection;   /* between .ORIG and .END */
+    int ended;       /* saw .END, the rest of the file is ignored */
+    int overflowed;  /* already reported running off memory on this line */
+    uint32_t pc;
+    int errors;
+};
+
+void asmError(struct asmState *as, const char *msg, const char *arg){
+
+    fprintf(stderr, "%s:%d: %s%s%s\n", as->path, as->line, msg, arg ? ": " : "", arg ? arg : "");
+    as->errors++;
+}
+
+const struct asmOp *findAsmOp(struct asmState *as, const char *name){
+
+    for (size_t i = 0; i < sizeof(asmOps) / sizeof(asmOps[0]); i++)
+    {
+        if (strcasecmp(asmOps[i].name, name) == 0) return &asmOps[i];
+    }
+    for (size_t i = 0; as->vm->extTraps && i < sizeof(asmExtOps) / sizeof(asmExtOps[0]); i++)
+    {
+        if (strcasecmp(asmExtOps[i].name, name) == 0) return &asmExtOps[i];
+    }
+    return NULL;
+}
+
+int isDirective(const char *tok){
+
+    return tok[0] == '.';
+}
+
+/* accepts #decimal, xhex, 0xhex, bbinary and plain decimal */
+int parseNumber(const char *tok, long *out){
+
+    const char *digits = tok;
+    int base = 10;
+    if (*tok == '#')
+    {
+        digits = tok + 1;
+    }
+    else if ((tok[0] == 'x' || tok[0] == 'X'))
+    {
+        digits = tok + 1;
+        base = 16;
+    }
+    else if (tok[0] == '0' && (tok[1] == 'x' || tok[1] == 'X'))
+    {
+        digits = tok + 2;
+        base = 16;
+    }
+    else if ((tok[0] == 'b' || tok[0] == 'B'))
+    {
+        digits = tok + 1;
+        base = 2;
+    }
+    const char *p = digits;
+    if (*p == '-' || *p == '+') p++;
+    if (!*p) return 0;
+    char *end;
+    long n = strtol(digits, &end, base);
+    if (*end) return 0;
+    *out = n;
+    return 1;
+}
+
+int parseRegister(struct asmState *as, const char *tok){
+
+    if ((tok[0] == 'R' || tok[0] == 'r') && tok[1] >= '0' && tok[1] <= '7' && !tok[2])
+    {
+        return tok[1] - '0';
+    }
+    asmError(as, "expected register", tok);
+    return 0;
+}
+
+int isValidLabel(const char *tok){
+
+    if (!((*tok >= 'A' && *tok <= 'Z') || (*tok >= 'a' && *tok <= 'z') || *tok == '_')) return 0;
+    for (const char *p = tok; *p; p++)
+    {
+        if (!((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') || *p == '_'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* checks that a value fits in a signed field of the given width */
+uint16_t asmField(struct asmState *as, long value, int bits, const char *tok){
+
+    long lo = -(1L << (bits - 1)), hi = (1L << (bits - 1)) - 1;
+    if (value < lo || value > hi)
+    {
+        asmError(as, "value out of range", tok);
+    }
+    return (uint16_t)value & ((1 << bits) - 1);
+}
+
+uint16_t asmImmediate(struct asmState *as, const char *tok, int bits){
+
+    long value;
+    if (!parseNumber(tok, &value))
+    {
+        asmError(as, "expected immediate", tok);
+        return 0;
+    }
+    return asmField(as, value, bits, tok);
+}
+
+/* a label becomes an offset from the incremented PC, a number is taken as the offset itself */
+uint16_t asmPcOffset(struct asmState *as, const char *tok, int bits){
+
+    long value;
+    if (parseNumber(tok, &value)) return asmField(as, value, bits, tok);
+
+    int sym = findSymbol(as->firstSymbol, tok);
+    if (sym < 0)
+    {
+        asmError(as, "undefined label", tok);
+        return 0;
+    }
+    return asmField(as, (long)symbols.entries[sym].address - (long)(as->pc + 1), bits, tok);
+}
+
+void asmEmit(struct asmState *as, uint16_t word){
+
+    if (as->pc >= MEMORY_MAX)
+    {
+        if (!as->overflowed) asmError(as, "program runs past the end of memory", NULL);
+        as->overflowed = 1;
+        return;
+    }
+    if (as->pass == 2) mem_write(as->vm, as->pc, word);
+    as->pc++;
+}
+
+int expectOperands(struct asmState *as, int ntok, int want, const char *name){
+
+    if (ntok - 1 != want)
+    {
+        asmError(as, "wrong number of operands for", name);
+        return 0;
+    }
+    return 1;
+}
+
+void asmInstruction(struct asmState *as, const struct asmOp *op, char **tok, int ntok){
+
+    uint16_t word = op->base;
+    if (as->pass == 1)
+    {
+        as->pc++;
+        return;
+    }
+    switch (op->kind)
+    {
+    case ASM_ADDAND:
+        if (!expectOperands(as, ntok, 3, tok[0])) break;
+        word |= parseRegister(as, tok[1]) << 9;
+        word |= parseRegister(as, tok[2]) << 6;
+        if ((tok[3][0] == 'R' || tok[3][0] == 'r') && tok[3][1] && !tok[3][2])
+        {
+            word |= parseRegister(as, tok[3]);
+        }
+        else
+        {
+            word |= (1 << 5) | asmImmediate(as, tok[3], 5);
+        }
+        break;
+    case ASM_NOT:
+        if (!expectOperands(as, ntok, 2, tok[0])) break;
+        word |= parseRegister(as, tok[1]) << 9;
+        word |= parseRegister(as, tok[2]) << 6;
+        break;
+    case ASM_BR:
+        if (!expectOperands(as, ntok, 1, tok[0])) break;
+        word |= asmPcOffset(as, tok[1], 9);
+        break;
+    case ASM_JMP:
+        if (!expectOperands(as, ntok, 1, tok[0])) break;
+        word |= parseRegister(as, tok[1]) << 6;
+        break;
+    case ASM_JSR:
+        if (!expectOperands(as, ntok, 1, tok[0])) break;
+        word |= asmPcOffset(as, tok[1], 11);
+        break;
+    case ASM_PCOFF9:
+        if (!expectOperands(as, ntok, 2, tok[0])) break;
+        word |= parseRegister(as, tok[1]) << 9;
+        word |= asmPcOffset(as, tok[2], 9);
+        break;
+    case ASM_BASEOFF6:
+        if (!expectOperands(as, ntok, 3, tok[0])) break;
+        word |= parseRegister(as, tok[1]) << 9;
+        word |= parseRegister(as, tok[2]) << 6;
+        word |= asmImmediate(as, tok[3], 6);
+        break;
+    case ASM_TRAP:
+    {
+        long vect;
+        if (!expectOperands(as, ntok, 1, tok[0])) break;
+        if (!parseNumber(tok[1], &vect) || vect < 0 || vect > 0xFF)
+        {
+            asmError(as, "bad trap vector", tok[1]);
+            break;
+        }
+        word |= (uint16_t)vect;
+    }
+        break;
+    case ASM_FIXED:
+        expectOperands(as, ntok, 0, tok[0]);
+        break;
+    }
+    asmEmit(as, word);
+}
+
+void asmStringz(struct asmState *as, const char *tok){
+
+    size_t len = strlen(tok);
+    if (len < 2 || tok[0] != '"' || tok[len - 1] != '"')
+    {
+        asmError(as, "expected string literal", tok);
+        return;
+    }
+    for (size_t i = 1; i < len - 1; i++)
+    {
+        char c = tok[i];
+        if (c == '\\' && i + 1 < len - 1)
+        {
+            switch (tok[++i])
+            {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'e': c = 27; break;
+            case '0': c = 0; break;
+            default: c = tok[i]; break;
+            }
+        }
+        asmEmit(as, (uint16_t)(unsigned char)c);
+    }
+    asmEmit(as, 0);
+}
+
+void asmDirective(struct asmState *as, char **tok, int ntok){
+
+    long value;
+    if (strcasecmp(tok[0], ".ORIG") == 0)
+    {
+        if (!expectOperands(as, ntok, 1, tok[0])) return;
+        if (as->inSection) asmError(as, ".ORIG without .END", NULL);
+        if (!parseNumber(tok[1], &value) || value < 0 || value >= MEMORY_MAX)
+        {
+            asmError(as, "bad origin", tok[1]);
+            return;
+        }
+        as->pc = (uint32_t)value;
+        as->inSection = 1;
+        return;
+    }
+    if (!as->inSection)
+    {
+        asmError(as, "directive outside .ORIG/.END", tok[0]);
+        return;
+    }
+    if (strcasecmp(tok[0], ".END") == 0)
+    {
+        as->inSection = 0;
+        as->ended = 1;
+    }
+    else if (strcasecmp(tok[0], ".FILL") == 0)
+    {
+        if (!expectOperands(as, ntok, 1, tok[0])) return;
+        if (parseNumber(tok[1], &value))
+        {
+            if (value < -32768 || value > 0xFFFF) asmError(as, "value out of range", tok[1]);
+            asmEmit(as, (uint16_t)value);
+        }
+        else if (as->pass == 1)
+        {
+            asmEmit(as, 0);
+        }
+        else
+        {
+            int sym = findSymbol(as->firstSymbol, tok[1]);
+            if (sym < 0) asmError(as, "undefined label", tok[1]);
+            asmEmit(as, sym < 0 ? 0 : symbols.entries[sym].address);
+        }
+    }
+    else if (strcasecmp(tok[0], ".BLKW") == 0)
+    {
+        long fill = 0;
+        if (ntok != 2 && ntok != 3)
+        {
+            asmError(as, "wrong number of operands for", tok[0]);
+            return;
+        }
+        if (!parseNumber(tok[1], &value) || value < 0 || value > MEMORY_MAX)
+        {
+            asmError(as, "bad block size", tok[1]);
+            return;
+        }
+        if (ntok == 3 && !parseNumber(tok[2], &fill)) asmError(as, "bad fill value", tok[2]);
+        while (value-- > 0) asmEmit(as, (uint16_t)fill);
+    }
+    else if (strcasecmp(tok[0], ".STRINGZ") == 0)
+    {
+        if (!expectOperands(as, ntok, 1, tok[0])) return;
+        asmStringz(as, tok[1]);
+    }
+    else
+    {
+        asmError(as, "unknown directive", tok[0]);
+    }
+}
+
+/* splits a line into tokens in place, keeping string literals whole and dropping comments */
+int tokenize(char *line, char **tok){
+
+    int ntok = 0;
+    char *p = line;
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r' || *p == '\n') p++;
+        if (!*p || *p == ';') break;
+        if (ntok == ASM_TOKENS_MAX) return -1;
+        tok[ntok++] = p;
+        if (*p == '"')
+        {
+            for (p++; *p && *p != '"'; p++)
+            {
+                if (*p == '\\' && p[1]) p++;
+            }
+            if (*p) p++;
+        }
+        else
+        {
+            while (*p && *p != ' ' && *p != '\t' && *p != ',' && *p != ';' && *p != '\r' && *p != '\n') p++;
+        }
+        if (*p == ';')
+        {
+            *p = '\0';
+            break;
+        }
+        if (*p) *p++ = '\0';
+    }
+    return ntok;
+}
+
+void assembleLine(struct asmState *as, char *line){
+
+    char *tokens[ASM_TOKENS_MAX];
+    char **tok = tokens;
+    int ntok = tokenize(line, tokens);
+    if (ntok < 0)
+    {
+        asmError(as, "too many operands", NULL);
+        return;
+    }
+    if (ntok == 0) return;
+
+    // a leading token that is neither an opcode nor a directive is a label
+    if (!isDirective(tok[0]) && !findAsmOp(as, tok[0]))
+    {
+        long value;
+        if (!isValidLabel(tok[0]))
+        {
+            asmError(as, "bad label", tok[0]);
+            return;
+        }
+        // operands are tried as numbers first, so such a label could never be referenced
+        if (parseNumber(tok[0], &value))
+        {
+            asmError(as, "label reads as a number", tok[0]);
+            return;
+        }
+        if (!as->inSection)
+        {
+            asmError(as, "label outside .ORIG/.END", tok[0]);
+            return;
+        }
+        if (as->pass == 1)
+        {
+            if (findSymbol(as->firstSymbol, tok[0]) >= 0)
+            {
+                asmError(as, "duplicate label", tok[0]);
+            }
+            else
+            {
+                addSymbol(tok[0], (uint16_t)as->pc);
+            }
+        }
+        tok++;
+        ntok--;
+        if (ntok == 0) return;
+    }
+
+    if (isDirective(tok[0]))
+    {
+        asmDirective(as, tok, ntok);
+        return;
+    }
+    const struct asmOp *op = findAsmOp(as, tok[0]);
+    if (!op)
+    {
+        asmError(as, "unknown opcode", tok[0]);
+        return;
+    }
+    if (!as->inSection)
+    {
+        asmError(as, "instruction outside .ORIG/.END", tok[0]);
+        return;
+    }
+    asmInstruction(as, op, tok, ntok);
+}
+
+/* two pass assembly straight into memory, labels are added to the symbol table */
+int assembleFile(vmState *vmState, const char *asmPath){
+
+    FILE *file = fopen(asmPath, "r");
+    if (!file) return 0;
+
+    struct asmState as;
+    memset(&as, 0, sizeof(as));
+    as.vm = vmState;
+    as.path = asmPath;
+    as.firstSymbol = symbols.count;
+
+    char line[ASM_LINE_MAX];
+    for (as.pass = 1; as.pass <= 2 && !as.errors; as.pass++)
+    {
+        rewind(file);
+        as.line = 0;
+        as.inSection = 0;
+        as.ended = 0;
+        while (!as.ended && fgets(line, sizeof(line), file))
+        {
+            as.line++;
+            as.overflowed = 0;
+            if (!strchr(line, '\n') && !feof(file))
+            {
+                asmError(&as, "line too long", NULL);
+                break;
+            }
+            assembleLine(&as, line);
+        }
+        if (as.inSection) asmError(&as, "missing .END", NULL);
+    }
+    fclose(file);
+    return as.errors == 0;
+}
+
+int isAsmFile(const char *path){
+
+    size_t len = strlen(path);
+    return len > 4 && strcasecmp(path + len - 4, ".asm") == 0;
+}
+
+/*
+    block profile and cache
+*/
+#define CACHE_MAGIC 0x4333434Cu /* "LC3C" */
+#define CACHE_VERSION 1
+
+struct cacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t imageHash;
+    uint32_t blockCount;
+    uint32_t reserved;
+};
+struct cacheBlock
+{
+    uint16_t start; /* block leader */
+    uint16_t end;   /* last instruction of the block */
+    uint32_t reserved;
+    uint64_t hits;  /* times the block was entered, summed over runs */
+};
+struct blockProfile
+{
+    uint64_t *hits; /* entries per leader address, NULL when not profiling */
+    uint64_t leaders[MEMORY_MAX / 64]; /* block leaders found statically or at run time */
+    uint64_t imageHash;
+    uint16_t *image; /* memory as loaded, stored with the cache for validation */
+    char *cachePath;
+    int fromCache;
+    int report;
+};
+struct blockProfile profile;
+
+#ifdef LC3_FUZZ
+#define EDGE_CT (1 << 16)
+/* libFuzzer picks up counters placed in this section as extra coverage */
+__attribute__((section("__libfuzzer_extra_counters")))
+uint8_t edgeCounters[EDGE_CT];
+#endif
+
+void markLeader(uint16_t address){
+    profile.leaders[address / 64] |= 1ull << (address % 64);
+}
+int isLeader(uint16_t address){
+    return profile.leaders[address / 64] >> (address % 64) & 1;
+}
+
+/* called for every taken branch, jump and call, the target starts a block */
+static inline void recordBranch(uint16_t from, uint16_t to, int profiling){
+    (void)from;
+    if (profiling && profile.hits) markLeader(to);
+#ifdef LC3_FUZZ
+    edgeCounters[((from << 5) ^ to) & (EDGE_CT - 1)]++;
+#endif
+}
+
+/* counts a block entry whenever execution reaches a leader, jumped to or fallen into */
+static inline void profileStep(uint16_t address){
+    if (isLeader(address)) profile.hits[address]++;
+}
+
+/* last instruction of the block starting at a leader */
+uint16_t blockEnd(const uint16_t *memory, uint16_t address){
+
+    for (int n = 0; n < MEMORY_MAX; n++, address++)
+    {
+        uint16_t instr = memory[address];
+        uint16_t opcode = instr >> 12;
+        int ends = opcode == OP_JMP || opcode == OP_JSR || opcode == OP_RTI || opcode == OP_RES
+                || (opcode == OP_BR && (instr & 0x0E00))
+                || (opcode == OP_TRAP && (instr & 0xFF) == TRAP_HALT);
+        if (ends || isLeader(address + 1)) return address;
     }
-    return mem;
+    return address;
 }
 
-void stopVm(vmState *vmState){
-    free(vmState);
-}
+/* follows control flow from the entry point to find basic block leaders */
+void discoverBlocks(const uint16_t *memory, uint16_t entry){
 
-void mem_write(vmState *vmState, uint16_t address, uint16_t val){
-    vmState->memory[address]=val;
-}
-uint16_t mem_read(vmState *vmState,uint16_t address){
-    if (address == MR_KBSR)
+    static uint64_t seen[MEMORY_MAX / 64];
+    static uint16_t work[MEMORY_MAX];
+    int top = 0;
+    memset(seen, 0, sizeof(seen));
+    work[top++] = entry;
+    markLeader(entry);
+
+    while (top > 0)
     {
-        if (checkKeys())
-        {
-            vmState->memory[MR_KBSR] = (1 << 15);
-            vmState->memory[MR_KBDR] = getchar();
-        }
-        else
+        uint16_t address = work[--top];
+        for (;;)
         {
-            vmState->memory[MR_KBSR] = 0;
+            if (seen[address / 64] >> (address % 64) & 1) break;
+            seen[address / 64] |= 1ull << (address % 64);
+
+            uint16_t instr = memory[address];
+            uint16_t opcode = instr >> 12;
+            uint16_t next = address + 1;
+            if (opcode == OP_BR && (instr & 0x0E00))
+            {
+                uint16_t target = next + sign_extend(instr & 0x1FF, 9);
+                markLeader(target);
+                work[top++] = target;
+                if ((instr & 0x0E00) == 0x0E00) break;
+                markLeader(next);
+            }
+            else if (opcode == OP_JSR)
+            {
+                if (instr & 0x0800)
+                {
+                    uint16_t target = next + sign_extend(instr & 0x7FF, 11);
+                    markLeader(target);
+                    work[top++] = target;
+                }
+                // the subroutine returns here
+                markLeader(next);
+            }
+            else if (opcode == OP_JMP || opcode == OP_RTI || opcode == OP_RES
+                     || (opcode == OP_TRAP && (instr & 0xFF) == TRAP_HALT))
+            {
+                break;
+            }
+            if (top >= MEMORY_MAX - 1) break;
+            address = next;
         }
     }
-    return vmState->memory[address];
 }
 
-/*
-    terminal
-*/
-struct termios originalTio;
+uint64_t hashImage(const uint16_t *memory){
 
-void disableInputBuffering(){
-    
-    //get current terminal attributes and store it in variable
-    tcgetattr(STDIN_FILENO, &originalTio);
-    struct termios newTio = originalTio;
-    /*
-        disables both canonical mode (ICANON- terminal doesn't wait for a newline 
-        character (like pressing Enter) to complete a line of input) and echoing 
-        (ECHO- terminal doesn't display the characters the user types on the 
-        screen) for a terminal 
-    */ 
-   newTio.c_lflag &= ~ICANON & ~ECHO;
-   tcsetattr(STDIN_FILENO,TCSANOW,&newTio);
+    uint64_t h = 0;
+    for (int i = 0; i < MEMORY_MAX / 4; i++)
+    {
+        uint64_t word;
+        memcpy(&word, memory + i * 4, sizeof(word));
+        h = mixHash(h, word);
+    }
+    return h;
 }
 
-void restoreInputBuffering(){
+/* loads leaders and hit counts when the cache entry matches the loaded image exactly */
+int loadCache(){
 
-    // set orignal attributes back
-    tcsetattr(STDIN_FILENO, TCSANOW, &originalTio);
-}
+    FILE *file = fopen(profile.cachePath, "rb");
+    if (!file) return 0;
 
-void handleInterrupt(int signal){
-    restoreInputBuffering();
-    printf("\n");
-    exit(-2);
+    struct cacheHeader header;
+    static uint16_t image[MEMORY_MAX];
+    int valid = fread(&header, sizeof(header), 1, file) == 1
+             && header.magic == CACHE_MAGIC && header.version == CACHE_VERSION
+             && header.imageHash == profile.imageHash && header.blockCount <= MEMORY_MAX
+             && fread(image, sizeof(image), 1, file) == 1
+             && memcmp(image, profile.image, sizeof(image)) == 0;
+    for (uint32_t i = 0; valid && i < header.blockCount; i++)
+    {
+        struct cacheBlock block;
+        if (fread(&block, sizeof(block), 1, file) != 1)
+        {
+            valid = 0;
+            break;
+        }
+        markLeader(block.start);
+        profile.hits[block.start] = block.hits;
+    }
+    fclose(file);
+    if (!valid)
+    {
+        // stale or damaged, rebuilt from scratch and replaced on exit
+        memset(profile.leaders, 0, sizeof(profile.leaders));
+        memset(profile.hits, 0, MEMORY_MAX * sizeof(uint64_t));
+    }
+    return valid;
 }
 
-uint16_t checkKeys(){
-    
-    fd_set readFds;
-    FD_ZERO(&readFds);
-    FD_SET(STDIN_FILENO,&readFds);
+int saveCache(){
 
-    struct timeval timeout;
-    timeout.tv_sec=0,timeout.tv_usec=0;
-    return select(1,&readFds,NULL,NULL,&timeout)!=0;
-}
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", profile.cachePath, (int)getpid());
+    FILE *file = fopen(tmpPath, "wb");
+    if (!file) return 0;
 
-/*
-    helper functions
-*/
-uint16_t sign_extend(uint16_t x, int bit_count)
-{
-    if ((x >> (bit_count - 1)) & 1) {
-        x |= (0xFFFF << bit_count);
-    }
-    return x;
-}
-uint16_t swap16(uint16_t x)
-{
-    return (x << 8) | (x >> 8);
-}
-void update_flags(vmState *vmState,int regId){
-    
-    if (vmState->regstr[regId] == 0)
+    struct cacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.imageHash = profile.imageHash;
+    for (int i = 0; i < MEMORY_MAX; i++)
     {
-        vmState->regstr[R_CD] = COND_Z;
+        if (isLeader(i)) header.blockCount++;
     }
-    else if (vmState->regstr[regId] >> 15) /* a 1 in the left-most bit indicates negative */
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(profile.image, MEMORY_MAX * sizeof(uint16_t), 1, file) == 1;
+    for (int i = 0; ok && i < MEMORY_MAX; i++)
     {
-        vmState->regstr[R_CD] = COND_N;
+        if (!isLeader(i)) continue;
+        struct cacheBlock block;
+        memset(&block, 0, sizeof(block));
+        block.start = i;
+        block.end = blockEnd(profile.image, i);
+        block.hits = profile.hits[i];
+        ok = fwrite(&block, sizeof(block), 1, file) == 1;
     }
-    else
+    ok = fclose(file) == 0 && ok;
+    // rename so concurrent runs of the same image never see a partial file
+    if (!ok || rename(tmpPath, profile.cachePath) != 0)
     {
-        vmState->regstr[R_CD] = COND_P;
+        unlink(tmpPath);
+        return 0;
     }
-    
+    return 1;
 }
-int readImageFile(vmState *vmState,const char* imgPath){
-    
-    FILE *file = fopen(imgPath,"rb");
-    if (!file)return 0;
-    
-    uint16_t origin;
-    fread(&origin,sizeof(uint16_t),1,file);
-    origin=swap16(origin);
-    // vmState->regstr[R_PC]=origin;
 
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t *p = vmState->memory + origin;
-    int read = fread(p, sizeof(uint16_t), max_read, file);
+void startProfile(const uint16_t *memory, const char *cacheDir, int report){
 
-    while (read-- >0 )
+    profile.report = report;
+    profile.hits = (uint64_t *)calloc(MEMORY_MAX, sizeof(uint64_t));
+    profile.image = (uint16_t *)malloc(MEMORY_MAX * sizeof(uint16_t));
+    memcpy(profile.image, memory, MEMORY_MAX * sizeof(uint16_t));
+    profile.imageHash = hashImage(memory);
+
+    if (cacheDir)
     {
-        *p=swap16(*p);
-        p++;
+        mkdir(cacheDir, 0755);
+        profile.cachePath = (char *)malloc(PATH_MAX);
+        snprintf(profile.cachePath, PATH_MAX, "%s/%016llx.lc3cache", cacheDir,
+                 (unsigned long long)profile.imageHash);
+        profile.fromCache = loadCache();
     }
-    fclose(file);
-    return 1;
-}
-
-int main(int argc, char const *argv[])
-{
-    if (argc < 2)
+    if (!profile.fromCache)
     {
-        /* show usage string */
-        printf("lc3 image-file ...\n");
-        exit(2);
+        discoverBlocks(memory, 0x3000);
     }
+}
 
-    vmState *vmState = initMem();
+void reportProfile(){
 
-    for (size_t i = 0; i < argc; i++)
+    enum { TOP_BLOCKS = 10 };
+    int top[TOP_BLOCKS];
+    int count = 0;
+    for (int i = 0; i < MEMORY_MAX; i++)
     {
-        if (!readImageFile(vmState,argv[i]))
+        if (!profile.hits[i]) continue;
+        // insertion into the short list of hottest blocks
+        int at = count < TOP_BLOCKS ? count++ : TOP_BLOCKS;
+        while (at > 0 && profile.hits[top[at - 1]] < profile.hits[i])
         {
-            printf("failed to load image: %s\n", argv[i]);
-            exit(1);
+            if (at < TOP_BLOCKS) top[at] = top[at - 1];
+            at--;
         }
+        if (at < TOP_BLOCKS) top[at] = i;
+    }
+    fprintf(stderr, "\nprofile: %s, hottest blocks\n", profile.fromCache ? "warm from cache" : "cold start");
+    for (int i = 0; i < count; i++)
+    {
+        char at[64];
+        fprintf(stderr, "profile: x%04X-x%04X %-24s %14llu\n", top[i], blockEnd(profile.image, top[i]),
+                symbolize(top[i], at, sizeof(at)), (unsigned long long)profile.hits[top[i]]);
     }
+}
 
-    signal(SIGINT, handleInterrupt);
-    disableInputBuffering();
+void finishProfile(){
 
-    vmState->regstr[R_CD]=COND_Z;
-    vmState->regstr[R_PC]=0x3000;
+    if (!profile.hits) return;
+    // blocks reached through indirect jumps are only known at run time
+    for (int i = 0; i < MEMORY_MAX; i++)
+    {
+        if (profile.hits[i]) markLeader(i);
+    }
+    if (profile.report) reportProfile();
+    if (profile.cachePath && !saveCache())
+    {
+        fprintf(stderr, "lc3: failed to write cache %s\n", profile.cachePath);
+    }
+    free(profile.hits);
+    profile.hits = NULL;
+}
+
+/*
+    the dispatch loop is expanded twice: a plain copy for ordinary runs and an
+    instrumented one that also feeds --profile and --metrics
+*/
+static inline __attribute__((always_inline)) int dispatch(vmState *vmState, const int instrumented){
 
     int isRunning=1;
+    int stopReason=STOP_HALT;
+    // PC and the count live in registers, vmState is brought up to date wherever something else can read them
+    uint16_t pc = vmState->regstr[R_PC];
+    uint64_t retired = vmState->retired;
     while (isRunning)
     {
-        uint16_t instr = vmState->memory[vmState->regstr[R_PC]++];
+        uint16_t instr = vmState->memory[pc];
         uint16_t opcode = instr >>12;
+        if (instrumented)
+        {
+            if (profile.hits) profileStep(pc);
+            if (vmState->counters) vmState->opcodes[opcode]++;
+        }
+        pc++;
+        if (++retired == vmState->nextSlice)
+        {
+            vmState->retired = retired;
+            vmState->regstr[R_PC] = pc;
+            if ((stopReason = endSlice(vmState))) break;
+        }
         switch (opcode)
         {
         case OP_ADD:
@@ -286,7 +2215,10 @@ int main(int argc, char const *argv[])
             uint16_t condFlag = (instr>>9) & 0b111;
             if (condFlag & vmState->regstr[R_CD])
             {
-                vmState->regstr[R_PC]+=pcOffset;
+                pc+=pcOffset;
+                recordBranch(pc - pcOffset - 1, pc, instrumented);
+                // keep this a host branch, as a cmov the next fetch would wait on the flags
+                __asm__ volatile("");
             }
         }
         break;
@@ -302,28 +2234,31 @@ int main(int argc, char const *argv[])
         case OP_JMP:
         {    
             uint16_t r1 = (instr >> 6) & 0x7;
-            vmState->regstr[R_PC] = vmState->regstr[r1];
+            recordBranch(pc - 1, vmState->regstr[r1], instrumented);
+            pc = vmState->regstr[r1];
         }
         break;
         case OP_JSR:
         {
             uint16_t lFlag = (instr>>11) & 0b1;
-            vmState->regstr[R_R7]=vmState->regstr[R_PC];
+            vmState->regstr[R_R7]=pc;
             if (lFlag)
             {
                 uint16_t lPcOffset = sign_extend(instr&0x7ff,11);
-                vmState->regstr[R_PC]+=lPcOffset;
+                pc+=lPcOffset;
             }else{
                 uint16_t tr = (instr>>6)&0b111;
-                vmState->regstr[R_PC]=vmState->regstr[tr];
+                pc=vmState->regstr[tr];
             }
+            recordBranch(vmState->regstr[R_R7] - 1, pc, instrumented);
         }
         break;
         case OP_LD:
         {
             uint16_t tr = (instr>>9)&0b111;
             uint16_t pcOffset = sign_extend(instr&0x1ff,9);
-            vmState->regstr[tr] = mem_read(vmState,vmState->regstr[R_PC]+pcOffset);
+            vmState->retired = retired;
+            vmState->regstr[tr] = mem_read(vmState,pc+pcOffset);
             update_flags(vmState,tr);
         }
         break;
@@ -331,7 +2266,8 @@ int main(int argc, char const *argv[])
         {    
             uint16_t tr = (instr>>9) & 0x7;
             uint16_t pcOffset = sign_extend(instr & 0x1ff,9);
-            vmState->regstr[tr]=mem_read(vmState,mem_read(vmState,vmState->regstr[R_PC]+pcOffset));
+            vmState->retired = retired;
+            vmState->regstr[tr]=mem_read(vmState,mem_read(vmState,pc+pcOffset));
             update_flags(vmState,tr);
         }
         break;
@@ -340,6 +2276,7 @@ int main(int argc, char const *argv[])
             uint16_t dr = (instr>>9) & 0b111;
             uint16_t sr1 = (instr>>6) & 0b111;
             uint16_t offset = sign_extend(instr & 0x3f,6);
+            vmState->retired = retired;
             vmState->regstr[dr] = mem_read(vmState,vmState->regstr[sr1]+offset);
             update_flags(vmState,dr);
             break;
@@ -348,7 +2285,7 @@ int main(int argc, char const *argv[])
         {
             uint16_t tr = (instr>>9) & 0b111;
             uint16_t pcOffset = sign_extend(instr & 0x1ff,9);
-            vmState->regstr[tr] = vmState->regstr[R_PC] + pcOffset;
+            vmState->regstr[tr] = pc + pcOffset;
             update_flags(vmState,tr);
         }
         break;
@@ -356,14 +2293,15 @@ int main(int argc, char const *argv[])
         {
             uint16_t tr = (instr >> 9) & 0b111;
             uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-            mem_write(vmState,vmState->regstr[R_PC] + pc_offset, vmState->regstr[tr]);
+            mem_write(vmState,pc + pc_offset, vmState->regstr[tr]);
         }
         break;
         case OP_STI:
         {
             uint16_t tr = (instr >> 9) & 0b111;
             uint16_t pcOffset = sign_extend(instr & 0x1FF, 9);
-            mem_write(vmState,mem_read(vmState,vmState->regstr[R_PC] + pcOffset), vmState->regstr[tr]);
+            vmState->retired = retired;
+            mem_write(vmState,mem_read(vmState,pc + pcOffset), vmState->regstr[tr]);
         }
         break;
         case OP_STR:
@@ -376,64 +2314,60 @@ int main(int argc, char const *argv[])
         break;
         case OP_TRAP:
         {    
-            vmState->regstr[R_R7]=vmState->regstr[R_PC];
+            vmState->regstr[R_R7]=pc;
+            vmState->retired = retired;
+            if (vmState->counters) vmState->traps[instr & 0xFF]++;
             switch (instr & 0xFF)
             {
                 case TRAP_GETC:
                 {
-                    vmState->regstr[R_R0] = (uint16_t)getchar();
+                    vmState->regstr[R_R0] = waitForChar(vmState);
                     update_flags(vmState,R_R0);
                 }
                     break;
                 case TRAP_OUT:
-                {    putc((char)vmState->regstr[R_R0], stdout);
+                {    uint64_t flushStart = latencyFlushBegin();
+                    putc((char)vmState->regstr[R_R0], stdout);
                     fflush(stdout);
+                    latencyFlushEnd(flushStart);
+                    vmState->outputBytes++;
                 }
                     break;
                 case TRAP_PUTS:
-                    {
-                        
-                        uint16_t* c = vmState->memory + vmState->regstr[R_R0];
-                        while (*c)
-                        {
-                            putc((char)*c, stdout);
-                            ++c;
-                        }
-                        fflush(stdout);
-                    }
+                    trapPuts(vmState);
                     break;
                 case TRAP_IN:
                     {
-                        printf("Enter a character: ");
-                        char c = getchar();
+                        vmState->outputBytes += printf("Enter a character: ");
+                        char c = waitForChar(vmState);
+                        uint64_t flushStart = latencyFlushBegin();
                         putc(c, stdout);
                         fflush(stdout);
+                        latencyFlushEnd(flushStart);
+                        vmState->outputBytes++;
                         vmState->regstr[R_R0] = (uint16_t)c;
                         update_flags(vmState,R_R0);
                     }
                     break;
                 case TRAP_PUTSP:
-                    {
-                        
-                        uint16_t* c = vmState->memory + vmState->regstr[R_R0];
-                        while (*c)
-                        {
-                            char char1 = (*c) & 0xFF;
-                            putc(char1, stdout);
-                            char char2 = (*c) >> 8;
-                            if (char2) putc(char2, stdout);
-                            ++c;
-                        }
-                        fflush(stdout);
-                    }
+                    trapPutsp(vmState);
                     break;
                 case TRAP_HALT:
                 {
+                    uint64_t flushStart = latencyFlushBegin();
                     puts("HALT");
                     fflush(stdout);
+                    latencyFlushEnd(flushStart);
+                    vmState->outputBytes += 5;
                     isRunning = 0;
                 }
                     break;
+                default:
+                    if (vmState->extTraps)
+                    {
+                        trapExt(vmState, instr & 0xFF);
+                    }
+                    break;
             }
         }
         break;
@@ -444,10 +2378,281 @@ int main(int argc, char const *argv[])
             break;
         }
     }
+    vmState->retired = retired;
+    vmState->regstr[R_PC] = pc;
+    return stopReason;
+}
+
+/* executes until HALT or a stop reason from a slice boundary */
+int runVm(vmState *vmState){
+
+    if (profile.hits || vmState->counters) return dispatch(vmState, 1);
+    return dispatch(vmState, 0);
+}
+
+void usage(){
+
+    /* show usage string */
+    printf("lc3 [--perf-counters] [--clock Hz] [--timer] [--metrics] [--profile]\n"
+           "    [--ext-traps] [--cache-dir dir] [--loop-check N] [--max-instructions N]\n"
+           "    [--latency-trace file] [--symbols file] image-file|source.asm ...\n");
+    exit(2);
+}
+
+uint64_t parseCount(const char *option, const char *value){
+
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (*value == '\0' || *value == '-' || *end != '\0' || n == 0)
+    {
+        printf("invalid value for %s: %s\n", option, value);
+        exit(2);
+    }
+    return n;
+}
+
+/*
+    fuzzing
+*/
+#ifdef LC3_FUZZ
+/*
+    libFuzzer entry points, built with
+        clang -DLC3_FUZZ -O2 -fsanitize=fuzzer main.c -o lc3fuzz
+    the images named in LC3_FUZZ_IMAGES (colon separated) are loaded once and
+    every fuzz input is fed to the guest as its keyboard stream. OP_RES/OP_RTI
+    still abort(), which is what libFuzzer reports as a crash.
+*/
+vmState *fuzzVm;
+vmState *fuzzBase; /* state right after loading */
+
+/* puts back only the pages written since the last reset */
+void resetVm(vmState *vmState, const struct lc3memory *base){
+
+    for (int w = 0; w < DIRTY_WORDS; w++)
+    {
+        while (vmState->dirty[w])
+        {
+            int page = w * 64 + __builtin_ctzll(vmState->dirty[w]);
+            vmState->dirty[w] &= vmState->dirty[w] - 1;
+            memcpy(vmState->memory + page * PAGE_SIZE, base->memory + page * PAGE_SIZE,
+                   PAGE_SIZE * sizeof(uint16_t));
+        }
+    }
+    memcpy(vmState->regstr, base->regstr, sizeof(vmState->regstr));
+    vmState->retired = 0;
+    vmState->cycleLatch = 0;
+    vmState->inputEvents = 0;
+    vmState->pendingStop = 0;
+    vmState->keyStream = NULL;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv){
+
+    (void)argc;
+    (void)argv;
+    const char *images = getenv("LC3_FUZZ_IMAGES");
+    if (!images)
+    {
+        fprintf(stderr, "set LC3_FUZZ_IMAGES to the image files to fuzz\n");
+        exit(2);
+    }
+    fuzzVm = initMem();
+    char *list = strdup(images);
+    for (char *path = strtok(list, ":"); path; path = strtok(NULL, ":"))
+    {
+        int loaded = isAsmFile(path) ? assembleFile(fuzzVm,path) : readImageFile(fuzzVm,path);
+        if (!loaded)
+        {
+            fprintf(stderr, "failed to load image: %s\n", path);
+            exit(1);
+        }
+    }
+    free(list);
+    fuzzVm->regstr[R_CD]=COND_Z;
+    fuzzVm->regstr[R_PC]=0x3000;
+
+    // runaway loops end the input instead of hanging the fuzzer
+    const char *budget = getenv("LC3_FUZZ_BUDGET");
+    loopCheck.budget = budget ? parseCount("LC3_FUZZ_BUDGET", budget) : 1000000;
+    loopCheck.quiet = 1;
+    vmClock.slice = SLICE_MAX;
+    freopen("/dev/null", "w", stdout);
+
+    memset(fuzzVm->dirty, 0, sizeof(fuzzVm->dirty));
+    fuzzBase = (vmState *)malloc(sizeof(vmState));
+    memcpy(fuzzBase, fuzzVm, sizeof(vmState));
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+
+    fuzzVm->keyStream = data;
+    fuzzVm->keyStreamLen = size;
+    fuzzVm->keyStreamPos = 0;
+    scheduleSlice(fuzzVm);
+    runVm(fuzzVm);
+    resetVm(fuzzVm, fuzzBase);
+    return 0;
+}
+#else
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+    }
+
+    vmState *vmState = initMem();
+    int perfCounters = 0;
+    uint64_t clockHz = 0;
+    const char *symbolPath = NULL;
+    uint64_t loopInterval = 0;
+    uint64_t budget = 0;
+    int useMetrics = 0;
+    const char *cacheDir = NULL;
+    int profileReport = 0;
+    const char *latencyPath = NULL;
+    const char **images = (const char **)malloc(argc * sizeof(const char *));
+    int imageCount = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--perf-counters") == 0)
+        {
+            perfCounters = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--clock") == 0)
+        {
+            if (i + 1 >= argc) usage();
+            clockHz = parseCount(argv[i], argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--loop-check") == 0)
+        {
+            if (i + 1 >= argc) usage();
+            loopInterval = parseCount(argv[i], argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--max-instructions") == 0)
+        {
+            if (i + 1 >= argc) usage();
+            budget = parseCount(argv[i], argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--cache-dir") == 0)
+        {
+            if (i + 1 >= argc) usage();
+            cacheDir = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--profile") == 0)
+        {
+            profileReport = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--latency-trace") == 0)
+        {
+            if (i + 1 >= argc) usage();
+            latencyPath = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--metrics") == 0)
+        {
+            useMetrics = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--ext-traps") == 0)
+        {
+            vmState->extTraps = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--timer") == 0)
+        {
+            vmState->timerMmio = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--symbols") == 0)
+        {
+            if (i + 1 >= argc) usage();
+            symbolPath = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage();
+        }
+        images[imageCount++] = argv[i];
+    }
+
+    // options apply to every image wherever they appear, e.g. --ext-traps to the assembler
+    for (int i = 0; i < imageCount; i++)
+    {
+        int loaded = isAsmFile(images[i]) ? assembleFile(vmState,images[i]) : readImageFile(vmState,images[i]);
+        if (!loaded)
+        {
+            printf("failed to load image: %s\n", images[i]);
+            exit(1);
+        }
+    }
+    free(images);
+    if (symbolPath && !writeSymbolFile(symbolPath))
+    {
+        printf("failed to write symbols: %s\n", symbolPath);
+        exit(1);
+    }
+
+    if (cacheDir || profileReport)
+    {
+        startProfile(vmState->memory, cacheDir, profileReport);
+        atexit(finishProfile);
+    }
+    if (useMetrics && !startMetrics())
+    {
+        // the job itself can still run, just without lc3top
+        fprintf(stderr, "lc3: failed to create metrics segment, continuing without --metrics\n");
+        useMetrics = 0;
+    }
+    vmState->counters = useMetrics;
+
+    signal(SIGINT, handleInterrupt);
+    disableInputBuffering();
+    if (latencyPath)
+    {
+        startLatencyTrace(latencyPath);
+    }
+    if (perfCounters)
+    {
+        // also reports when the session is ended with ctrl-c
+        atexit(reportPerfCounters);
+        startPerfCounters(&vmState->retired);
+    }
+
+    vmState->regstr[R_CD]=COND_Z;
+    vmState->regstr[R_PC]=0x3000;
+
+    startClock(clockHz);
+    startLoopCheck(vmState, loopInterval, budget);
+    scheduleSlice(vmState);
+    recordBranch(vmState->regstr[R_PC], vmState->regstr[R_PC], 1);
+
+    int stopReason = runVm(vmState);
     restoreInputBuffering();
+    publishMetrics(vmState, LC3_STOPPED);
+    reportPerfCounters();
+    finishProfile();
+    finishLatencyTrace();
     stopVm(vmState);
-    return 0;
+    return stopReason;
 }
+#endif
 // /*
 //     source template
 // */